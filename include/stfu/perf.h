@@ -0,0 +1,204 @@
+#ifndef STFU_PERF_H
+#define STFU_PERF_H
+
+/// Everything in here is public. But unlike expect.h, stfu.h only
+/// includes this with STFU_IMPL because it pulls in system headers.
+/// Tests that use measure include stfu/perf.h themselves
+
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <functional>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace stfu {
+
+    /// Readings taken around a piece of code. Wall clock time is too
+    /// noisy to catch small regressions. Instructions retired barely
+    /// move between runs so they make for useful thresholds.
+    struct perf_counters {
+        /// False when hardware counters could not be opened or the kernel
+        /// never scheduled them. For example on non linux platforms,
+        /// inside most containers or when perf_event_paranoid forbids it.
+        /// Only cpu_time is valid then
+        bool hardware = false;
+
+        uint64_t cycles = 0;
+        uint64_t instructions = 0;
+        uint64_t cache_misses = 0;
+        uint64_t branch_misses = 0;
+
+        /// CPU time of the calling thread in nanoseconds. Always available
+        uint64_t cpu_time = 0;
+
+        /// Readings divided by the number of calls. Handy to say something
+        /// like "parsing should take less than 500 instructions per call"
+        perf_counters per_call(uint64_t calls) const {
+            perf_counters result = *this;
+            if (calls == 0) {
+                return result;
+            }
+            result.cycles /= calls;
+            result.instructions /= calls;
+            result.cache_misses /= calls;
+            result.branch_misses /= calls;
+            result.cpu_time /= calls;
+            return result;
+        }
+    };
+
+    namespace impl {
+
+        /// Thread CPU time in nanoseconds. Falls back to std::clock which
+        /// is process wide on platforms without clock_gettime
+        inline uint64_t thread_cpu_time() {
+#if defined(__unix__) || defined(__APPLE__)
+            timespec ts{};
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+            return uint64_t(ts.tv_sec) * 1000000000ULL + uint64_t(ts.tv_nsec);
+#else
+            return uint64_t(std::clock()) * 1000000000ULL / CLOCKS_PER_SEC;
+#endif
+        }
+
+        /// Opens a group of hardware counters for the calling thread.
+        /// Counting starts on start and stops on stop. If the counters
+        /// cannot be opened, only CPU time is measured.
+        ///
+        /// The file descriptors are closed in the destructor. That way an
+        /// expect failing in the measured code does not leak them.
+        class perf_sampler {
+#ifdef __linux__
+            static const int counter_count = 4;
+            int fds[counter_count] = {-1, -1, -1, -1};
+
+            static int open_counter(uint64_t config, int group_fd) {
+                perf_event_attr attr;
+                std::memset(&attr, 0, sizeof(attr));
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.size = sizeof(attr);
+                attr.config = config;
+                attr.read_format = PERF_FORMAT_GROUP
+                                   | PERF_FORMAT_TOTAL_TIME_ENABLED
+                                   | PERF_FORMAT_TOTAL_TIME_RUNNING;
+                /// Only the leader starts disabled. The rest follow it
+                attr.disabled = group_fd == -1 ? 1 : 0;
+                attr.exclude_kernel = 1;
+                attr.exclude_hv = 1;
+                return int(syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0));
+            }
+
+            void close_all() {
+                for (int &fd : fds) {
+                    if (fd != -1) {
+                        close(fd);
+                        fd = -1;
+                    }
+                }
+            }
+#endif
+            uint64_t cpu_start = 0;
+
+        public:
+            perf_sampler() {
+#ifdef __linux__
+                const uint64_t configs[counter_count] = {
+                        PERF_COUNT_HW_CPU_CYCLES,
+                        PERF_COUNT_HW_INSTRUCTIONS,
+                        PERF_COUNT_HW_CACHE_MISSES,
+                        PERF_COUNT_HW_BRANCH_MISSES
+                };
+
+                for (int i = 0; i < counter_count; i++) {
+                    fds[i] = open_counter(configs[i], fds[0]);
+                    if (fds[i] == -1) {
+                        /// All or nothing. Half a group would make the
+                        /// readings impossible to compare between machines
+                        close_all();
+                        return;
+                    }
+                }
+#endif
+            }
+
+            perf_sampler(const perf_sampler &) = delete;
+            perf_sampler &operator=(const perf_sampler &) = delete;
+
+            ~perf_sampler() {
+#ifdef __linux__
+                close_all();
+#endif
+            }
+
+            void start() {
+#ifdef __linux__
+                if (fds[0] != -1) {
+                    ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+                    ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+                }
+#endif
+                cpu_start = thread_cpu_time();
+            }
+
+            perf_counters stop() {
+                perf_counters result;
+                result.cpu_time = thread_cpu_time() - cpu_start;
+#ifdef __linux__
+                if (fds[0] == -1) {
+                    return result;
+                }
+
+                ioctl(fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+                /// read gives the number of counters, the time the group was
+                /// enabled, the time it actually ran and then the values in
+                /// the order the counters were opened
+                uint64_t values[3 + counter_count] = {};
+                if (read(fds[0], values, sizeof(values)) != ssize_t(sizeof(values))
+                    || values[0] != uint64_t(counter_count)) {
+                    return result;
+                }
+
+                /// The kernel never put the group on the PMU. For example
+                /// because the NMI watchdog holds a counter. All values are
+                /// 0 then and a threshold would pass without measuring
+                uint64_t enabled = values[1], running = values[2];
+                if (running == 0) {
+                    return result;
+                }
+
+                /// The group shared the PMU with other events for part of
+                /// the time. Scale up the same way perf stat does
+                double scale = running < enabled ? double(enabled) / double(running) : 1.0;
+
+                result.hardware = true;
+                result.cycles = uint64_t(double(values[3]) * scale);
+                result.instructions = uint64_t(double(values[4]) * scale);
+                result.cache_misses = uint64_t(double(values[5]) * scale);
+                result.branch_misses = uint64_t(double(values[6]) * scale);
+#endif
+                return result;
+            }
+        };
+    } /// namespace impl
+
+    /// Runs func the given number of times and returns the counters
+    /// for all of them together. Use perf_counters::per_call to get the
+    /// readings for a single call. Exceptions thrown by func propagate.
+    inline perf_counters measure(const std::function<void()> &func, uint64_t calls = 1) {
+        impl::perf_sampler sampler;
+        sampler.start();
+        for (uint64_t i = 0; i < calls; i++) {
+            func();
+        }
+        return sampler.stop();
+    }
+} /// namespace stfu
+
+#endif //STFU_PERF_H
@@ -9,19 +9,67 @@
 #include <cassert>
 #include <algorithm>
 #include <iostream>
+#include <fstream>
+#include <cstdint>
+#include <chrono>
+#include <map>
+#include <cstdio>
+#include <stdexcept>
+#include <random>
+#include <cstdlib>
 
 #include "expect.h"
 
 namespace stfu {
-    /// int is a dummy return value. You are free to ignore this for
-    /// single file test cases. But we need to assign some value to
-    /// a static variable to be able to call a function in another
-    /// translation unit automatically on executing
+    /// You are free to ignore the return value for single file test
+    /// cases. But we need to assign some value to a static variable to
+    /// be able to call a function in another translation unit
+    /// automatically on executing.
+    ///
+    /// For root tests it is 1 if the test ran and 0 if it was skipped
+    /// because of --list, --shard or --fail-fast. Nested tests always
+    /// return 0
     int test(const std::string &name, const std::function<void()> &func);
+
+    /// Reads the command line flags stfu understands and ignores the rest,
+    /// so you can pass argc and argv straight from main. Flags -
+    ///
+    /// --list             Print the leaves recorded in the manifest and
+    ///                    skip running any test
+    /// --manifest=<path>  Where the manifest is read from and written to.
+    ///                    Defaults to stfu.manifest
+    /// --no-manifest      Do not read or write the manifest
+    /// --shard=<k>/<n>    Only run the root tests assigned to shard k
+    ///                    (0 based) out of n
+    /// --perf             Print hardware counters for every leaf
+    /// --fail-fast        Stop the whole run at the first failed leaf
+    /// --max-failures <n> Stop the whole run after n failed leaves
+    ///
+    /// Tests registered through static variables run before main. So
+    /// they run before configure gets a chance to change anything.
+    void configure(int argc, const char *const *argv);
+
+    /// True when configure was given --list. No test runs in that case
+    bool list_only();
+
+    /// Prints how many leaves ran, failed and were skipped because of
+    /// --fail-fast or --max-failures. Returns 1 if anything failed or
+    /// was skipped and 0 otherwise.
+    ///
+    /// Calling this is optional. If report was never called, stfu prints
+    /// the summary when the program exits and exits with 1 if anything
+    /// failed, whatever main returned. It does so with _Exit, which skips
+    /// atexit handlers like the one gcov uses to write coverage data.
+    int report();
 }
 
 /// Implementation details. Subject to change
 #ifdef STFU_IMPL
+
+/// Needed by --perf. Kept out of the public part because it pulls in
+/// system headers that every test file does not need
+#include "perf.h"
+
 /**
  * Contains all the implementation details. Skip to definition of test
  * to find the public contract of this library with the outside world
@@ -30,6 +78,103 @@ namespace stfu {
     namespace impl {
 
 
+        /**
+         * Options set through stfu::configure.
+         *
+         * This and the other run wide state with non trivial constructors
+         * live in function level statics. Tests in static variables of
+         * other translation units can run before the globals of this one
+         * are constructed. Function level statics are constructed on
+         * first use instead.
+         */
+        struct options_t {
+            std::string manifest_path = "stfu.manifest";
+            bool use_manifest = true;
+            bool list = false;
+            size_t shard_index = 0;
+            size_t shard_count = 1;
+            bool perf = false;
+
+            /// Cancel the run once this many leaves have failed. 0 means
+            /// never cancel
+            size_t max_failures = 0;
+        };
+
+        options_t &options() {
+            static options_t instance;
+            return instance;
+        }
+
+
+        /**
+         * What happened during the run so far. Printed by stfu::report
+         */
+        struct stats_t {
+            size_t executed = 0;
+            size_t failed = 0;
+            size_t skipped = 0;
+
+            /// Set when max_failures is hit. Nothing runs after that
+            bool cancelled = false;
+
+            /// Only one leaf runs per cycle. So failures are collected
+            /// here and counted once at the end of the cycle. Otherwise a
+            /// parent failing after its child failed would count twice
+            bool cycle_failed = false;
+
+            /// Set by stfu::report so that at_exit does not print the
+            /// summary a second time
+            bool reported = false;
+        };
+
+        stats_t stats;
+
+
+        /**
+         * A node of the test tree as recorded in the manifest.
+         *
+         * The tree is only discovered by running the tests. So after every
+         * root test runs, we record what we saw and save it when the
+         * program exits. That way listing tests or planning shards does
+         * not need to execute every parent body.
+         */
+        struct manifest_node {
+            std::string name;
+
+            /// Nanoseconds taken by the last cycle that executed this node
+            /// as a leaf. That includes the parent bodies because that is
+            /// the real cost of running the leaf. 0 for non leaf nodes
+            uint64_t duration = 0;
+
+            std::vector<manifest_node> children;
+
+            /// Sum of durations of all the leaves under this node
+            uint64_t cost() const {
+                if (children.empty()) {
+                    return duration;
+                }
+
+                uint64_t total = 0;
+                for (const auto &child : children) {
+                    total += child.cost();
+                }
+                return total;
+            }
+
+            size_t leaf_count() const {
+                if (children.empty()) {
+                    return 1;
+                }
+
+                size_t total = 0;
+                for (const auto &child : children) {
+                    total += child.leaf_count();
+                }
+                return total;
+            }
+        };
+
+
         /**
          * Represents the state of a test case
          */
@@ -126,6 +271,14 @@ namespace stfu {
                     : func(std::move(test_func)), parent(test_parent), name(std::move(test_name)) {}
 
 
+            /**
+             * Nanoseconds taken by the cycle in which this test case was
+             * executed as a leaf. Set by run_tests. Stays 0 for non leaf
+             * test cases.
+             */
+            uint64_t duration = 0;
+
+
             /**
              * Adds a child if a child with same name doesn'lhs already exist
              * It will run the child if children is empty or if in this
@@ -162,9 +315,11 @@ namespace stfu {
                             children[next_child_to_execute]->run();
                         } catch (std::exception &e) {
                             std::cout << name << " failed: " << e.what() << '\n';
+                            stats.cycle_failed = true;
 //                            failed_tests.push_back(root);
                         } catch (...) {
                             std::cout << "Unknown exception caught\n";
+                            stats.cycle_failed = true;
 //                            failed_tests.push_back(root);
                         }
 
@@ -221,8 +376,509 @@ namespace stfu {
                     parent->increment_children_executed();
                 }
             }
+
+
+            /**
+             * The leaf that the current cycle executes. Has to be called
+             * before cycle_complete because that moves on to the next child
+             */
+            test_case *executing_leaf() {
+                if (next_child_to_execute < children.size()) {
+                    return children[next_child_to_execute]->executing_leaf();
+                }
+                return this;
+            }
+
+
+            /**
+             * Number of leaves under this test case that have not run yet.
+             * Children that were never discovered cannot be counted. So
+             * this is a lower bound until every parent has run once.
+             */
+            size_t pending_leaves() const {
+                if (children.empty()) {
+                    return first_execution ? 1 : 0;
+                }
+
+                size_t total = 0;
+                for (size_t i = next_child_to_execute; i < children.size(); i++) {
+                    total += children[i]->pending_leaves();
+                }
+                return total;
+            }
+
+
+            /**
+             * Names from the root down to this test case joined with " / "
+             */
+            std::string path() const {
+                return parent ? parent->path() + " / " + name : name;
+            }
+
+
+            /**
+             * Converts the tree discovered so far into a manifest node
+             */
+            manifest_node to_manifest() const {
+                manifest_node node;
+                node.name = name;
+                node.duration = children.empty() ? duration : 0;
+                for (const auto &child : children) {
+                    node.children.push_back(child->to_manifest());
+                }
+                return node;
+            }
+        };
+
+
+        /**
+         * Reading and writing the manifest.
+         *
+         * The format is deliberately dumb. All integers are little endian.
+         * "STFU", u32 version, u32 number of roots and then every node in
+         * pre order as u32 name length, name bytes, u64 duration and
+         * u32 number of children.
+         */
+        namespace manifest_io {
+            const uint32_t version = 1;
+
+            inline void write_int(std::ostream &os, uint64_t value, int bytes) {
+                for (int i = 0; i < bytes; i++) {
+                    os.put(char((value >> (8 * i)) & 0xff));
+                }
+            }
+
+            inline bool read_int(std::istream &is, uint64_t &value, int bytes) {
+                value = 0;
+                for (int i = 0; i < bytes; i++) {
+                    int c = is.get();
+                    if (c == std::char_traits<char>::eof()) {
+                        return false;
+                    }
+                    value |= uint64_t(c & 0xff) << (8 * i);
+                }
+                return true;
+            }
+
+            inline void write_node(std::ostream &os, const manifest_node &node) {
+                write_int(os, node.name.size(), 4);
+                os.write(node.name.data(), std::streamsize(node.name.size()));
+                write_int(os, node.duration, 8);
+                write_int(os, node.children.size(), 4);
+                for (const auto &child : node.children) {
+                    write_node(os, child);
+                }
+            }
+
+            inline bool read_node(std::istream &is, manifest_node &node) {
+                uint64_t name_length, child_count;
+                if (!read_int(is, name_length, 4)) {
+                    return false;
+                }
+
+                /// Read in chunks for the same reason as the children below.
+                /// A corrupt length should fail on eof, not allocate gigabytes
+                node.name.clear();
+                char buffer[4096];
+                while (name_length) {
+                    auto chunk = std::min<uint64_t>(name_length, sizeof(buffer));
+                    if (!is.read(buffer, std::streamsize(chunk))) {
+                        return false;
+                    }
+                    node.name.append(buffer, size_t(chunk));
+                    name_length -= chunk;
+                }
+
+                if (!read_int(is, node.duration, 8) || !read_int(is, child_count, 4)) {
+                    return false;
+                }
+
+                /// Children are read one by one instead of resizing upfront.
+                /// A corrupt count should fail on eof, not allocate gigabytes
+                for (uint64_t i = 0; i < child_count; i++) {
+                    manifest_node child;
+                    if (!read_node(is, child)) {
+                        return false;
+                    }
+                    node.children.push_back(std::move(child));
+                }
+                return true;
+            }
+
+            /// Returns false if the file is missing or corrupt. roots is
+            /// left untouched in that case
+            inline bool load(const std::string &path, std::vector<manifest_node> &roots) {
+                std::ifstream file(path, std::ios::binary);
+                char magic[4];
+                if (!file.read(magic, 4) || std::string(magic, 4) != "STFU") {
+                    return false;
+                }
+
+                uint64_t file_version, root_count;
+                if (!read_int(file, file_version, 4) || file_version != version
+                    || !read_int(file, root_count, 4)) {
+                    return false;
+                }
+
+                std::vector<manifest_node> loaded;
+                for (uint64_t i = 0; i < root_count; i++) {
+                    manifest_node node;
+                    if (!read_node(file, node)) {
+                        return false;
+                    }
+                    loaded.push_back(std::move(node));
+                }
+
+                roots = std::move(loaded);
+                return true;
+            }
+
+            /// Writes to a temporary file first and renames it so that
+            /// a crash halfway does not leave a corrupt manifest behind.
+            /// The temporary name is random because shards running in the
+            /// same directory save at the same time.
+            inline void save(const std::string &path, const std::vector<manifest_node> &roots) {
+                std::random_device random;
+                std::string temporary = path + ".tmp" + std::to_string(random());
+                {
+                    std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+                    if (!file) {
+                        return;
+                    }
+
+                    file.write("STFU", 4);
+                    write_int(file, version, 4);
+                    write_int(file, roots.size(), 4);
+                    for (const auto &root : roots) {
+                        write_node(file, root);
+                    }
+                }
+
+#ifdef _WIN32
+                /// rename does not replace an existing file on windows.
+                /// Everywhere else it does so atomically
+                std::remove(path.c_str());
+#endif
+                if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+                    std::remove(temporary.c_str());
+                }
+            }
+        } /// namespace manifest_io
+
+
+        /**
+         * The manifest as loaded from disk and updated with every root
+         * test that runs. Loaded lazily on first use.
+         */
+        struct manifest_state_t {
+            std::vector<manifest_node> roots;
+            bool loaded = false;
+
+            /// Names of the roots that ran in this process. Only these
+            /// are written back. Everything else on disk is left alone
+            /// so that shards sharing a manifest do not undo each other
+            std::vector<std::string> updated;
+        };
+
+        manifest_state_t &manifest_state() {
+            static manifest_state_t instance;
+            return instance;
+        }
+
+
+        std::vector<manifest_node> &get_manifest() {
+            auto &state = manifest_state();
+            if (!state.loaded && options().use_manifest) {
+                std::vector<manifest_node> on_disk;
+                manifest_io::load(options().manifest_path, on_disk);
+
+                /// Roots already in memory ran before configure changed
+                /// the path. They are newer than what is on disk
+                for (auto &root : state.roots) {
+                    auto it = std::find_if(on_disk.begin(), on_disk.end(), [&](const manifest_node &m) {
+                        return m.name == root.name;
+                    });
+                    if (it != on_disk.end()) {
+                        *it = std::move(root);
+                    } else {
+                        on_disk.push_back(std::move(root));
+                    }
+                }
+                state.roots = std::move(on_disk);
+            }
+            state.loaded = true;
+            return state.roots;
+        }
+
+
+        /**
+         * Folds the tree seen in a run into the recorded one. Children
+         * the run did not see are kept. Leaves only take the duration
+         * of the run if they actually ran in it.
+         */
+        void merge_manifest(manifest_node &recorded, const manifest_node &seen) {
+            if (seen.children.empty()) {
+                if (recorded.children.empty() && seen.duration) {
+                    recorded.duration = seen.duration;
+                }
+                return;
+            }
+
+            recorded.duration = 0;
+            for (const auto &child : seen.children) {
+                auto it = std::find_if(recorded.children.begin(), recorded.children.end(),
+                                       [&](const manifest_node &m) {
+                                           return m.name == child.name;
+                                       });
+
+                if (it != recorded.children.end()) {
+                    merge_manifest(*it, child);
+                } else {
+                    recorded.children.push_back(child);
+                }
+            }
+        }
+
+
+        /**
+         * Records the tree of a root that just ran.
+         *
+         * The first time a root completes cleanly in this process, its
+         * recorded tree is replaced. That takes care of tests that were
+         * added, removed or renamed since the last run.
+         *
+         * Otherwise what we saw is merged into what was recorded. A root
+         * that failed or was cancelled only saw part of its tree. And
+         * nothing stops two roots from having the same name, like the
+         * ones in main2.cpp and main3.cpp. Replacing would lose the
+         * leaves of the first one.
+         */
+        void update_manifest(manifest_node node, bool complete) {
+            if (!options().use_manifest) {
+                return;
+            }
+
+            auto &roots = get_manifest();
+            auto &updated = manifest_state().updated;
+            bool first = std::find(updated.begin(), updated.end(), node.name) == updated.end();
+            if (first) {
+                updated.push_back(node.name);
+            }
+
+            auto it = std::find_if(roots.begin(), roots.end(), [&](const manifest_node &m) {
+                return m.name == node.name;
+            });
+
+            if (it == roots.end()) {
+                roots.push_back(std::move(node));
+            } else if (complete && first) {
+                *it = std::move(node);
+            } else {
+                merge_manifest(*it, node);
+            }
+        }
+
+
+        /**
+         * Writes the roots that ran in this process to the manifest.
+         *
+         * The file is read again right before writing. Shards running at
+         * the same time in the same directory then only replace their
+         * own roots instead of the whole file they loaded at startup.
+         *
+         * Called once when the program exits. Saving after every root
+         * would rewrite the whole file once per root.
+         *
+         * Sharded runs never write. Every shard has to plan from the same
+         * file, and a shard that finished first would change it under the
+         * ones that start later.
+         */
+        void flush_manifest() {
+            auto &state = manifest_state();
+            if (!options().use_manifest || options().shard_count > 1 || state.updated.empty()) {
+                return;
+            }
+
+            std::vector<manifest_node> on_disk;
+            manifest_io::load(options().manifest_path, on_disk);
+
+            for (const auto &name : state.updated) {
+                auto ours = std::find_if(state.roots.begin(), state.roots.end(), [&](const manifest_node &m) {
+                    return m.name == name;
+                });
+                if (ours == state.roots.end()) {
+                    continue;
+                }
+
+                auto theirs = std::find_if(on_disk.begin(), on_disk.end(), [&](const manifest_node &m) {
+                    return m.name == name;
+                });
+                if (theirs != on_disk.end()) {
+                    *theirs = *ours;
+                } else {
+                    on_disk.push_back(*ours);
+                }
+            }
+
+            manifest_io::save(options().manifest_path, on_disk);
+            state.updated.clear();
+        }
+
+
+        void print_summary() {
+            std::cout << stats.executed << " leaves run, "
+                      << stats.failed << " failed, "
+                      << stats.skipped << " skipped\n";
+
+            if (stats.cancelled) {
+                std::cout << "Run cancelled after " << stats.failed << " failures\n";
+            }
+        }
+
+
+        int exit_status() {
+            return stats.failed || stats.skipped ? 1 : 0;
+        }
+
+
+        /**
+         * Saves the manifest. If main never called stfu::report, like
+         * suites with tests in static variables and an empty main, this
+         * also prints the summary and makes the exit code reflect failures.
+         *
+         * There is no portable way to change the exit code from here. So
+         * on failure this flushes the output and calls _Exit. That skips
+         * whatever was registered with atexit before the first test, like
+         * gcov writing coverage data or LeakSanitizer. It also replaces
+         * any exit code main returned with 1. Call stfu::report from main
+         * to avoid both.
+         */
+        void at_exit() {
+            flush_manifest();
+
+            if (stats.reported) {
+                return;
+            }
+
+            if (stats.executed) {
+                print_summary();
+            }
+
+            if (exit_status()) {
+                std::cout.flush();
+                std::cerr.flush();
+                std::fflush(nullptr);
+                std::_Exit(exit_status());
+            }
+        }
+
+
+        /**
+         * Registers at_exit the first time stfu is used. The statics it
+         * touches are constructed before registering so that they are
+         * destroyed only after at_exit has run.
+         */
+        void ensure_exit_hook() {
+            static bool registered = false;
+            if (registered) {
+                return;
+            }
+            registered = true;
+
+            options();
+            manifest_state();
+            std::atexit(at_exit);
+        }
+
+
+        /// Number of leaves recorded for the given root. 0 if unknown
+        size_t recorded_leaves(const std::string &name) {
+            for (const auto &root : get_manifest()) {
+                if (root.name == name) {
+                    return root.leaf_count();
+                }
+            }
+            return 0;
+        }
+
+
+        void print_leaves(const manifest_node &node, const std::string &prefix) {
+            std::string path = prefix.empty() ? node.name : prefix + " / " + node.name;
+            if (node.children.empty()) {
+                std::cout << path << " (" << double(node.duration) / 1e6 << " ms)\n";
+                return;
+            }
+
+            for (const auto &child : node.children) {
+                print_leaves(child, path);
+            }
+        }
+
+
+        /**
+         * Assignment of root tests to shards. Computed once from the
+         * manifest file, not from the manifest in memory which roots that
+         * already ran have updated. Sharded runs do not write the file.
+         * So every shard plans from the same input and each root runs in
+         * exactly one of them.
+         *
+         * Roots are handed out biggest recorded cost first, each to the
+         * shard with the least total cost so far. Balancing by leaf count
+         * would put one slow leaf on par with one fast leaf.
+         */
+        struct shard_plan_t {
+            std::map<std::string, size_t> shards;
+            bool ready = false;
         };
 
+        shard_plan_t &shard_plan() {
+            static shard_plan_t instance;
+            return instance;
+        }
+
+
+        /// The shard the given root test belongs to
+        size_t shard_for(const std::string &name) {
+            auto &plan = shard_plan();
+            if (!plan.ready) {
+                std::vector<manifest_node> recorded;
+                if (options().use_manifest) {
+                    manifest_io::load(options().manifest_path, recorded);
+                }
+
+                std::vector<const manifest_node *> roots;
+                for (const auto &root : recorded) {
+                    roots.push_back(&root);
+                }
+
+                std::stable_sort(roots.begin(), roots.end(), [](const manifest_node *a, const manifest_node *b) {
+                    return a->cost() > b->cost();
+                });
+
+                std::vector<uint64_t> load(options().shard_count, 0);
+                for (const auto *root : roots) {
+                    auto lightest = size_t(std::min_element(load.begin(), load.end()) - load.begin());
+                    load[lightest] += root->cost();
+                    plan.shards[root->name] = lightest;
+                }
+                plan.ready = true;
+            }
+
+            auto it = plan.shards.find(name);
+            if (it != plan.shards.end()) {
+                return it->second;
+            }
+
+            /// Never seen this root before. Every shard runs the same binary
+            /// so the hash agrees across them
+            return std::hash<std::string>()(name) % options().shard_count;
+        }
+
+
+        bool in_current_shard(const std::string &name) {
+            return options().shard_count <= 1 || shard_for(name) == options().shard_index;
+        }
+
 
         /**
          * To execute tests, we need the root.
@@ -251,7 +907,14 @@ namespace stfu {
             /// Update impl::current_test because we are running now.
             /// So all nested tests are our children.
             impl::current_test = this;
-            func();
+            try {
+                func();
+            } catch (...) {
+                /// Without this, siblings declared after a failed test
+                /// would be added as its children and run in the same cycle
+                impl::current_test = parent;
+                throw;
+            }
             /// We have completed running. So all the children left are
             /// our parent's children
             impl::current_test = parent;
@@ -261,6 +924,17 @@ namespace stfu {
             first_execution = false;
         }
 
+        void print_perf(const std::string &path, const perf_counters &counters) {
+            std::cout << "[perf] " << path << ": cpu time " << counters.cpu_time << " ns";
+            if (counters.hardware) {
+                std::cout << ", cycles " << counters.cycles
+                          << ", instructions " << counters.instructions
+                          << ", cache misses " << counters.cache_misses
+                          << ", branch misses " << counters.branch_misses;
+            }
+            std::cout << '\n';
+        }
+
         void run_tests(const std::string &name, const std::function<void()> &func) {
             std::vector<std::shared_ptr<impl::test_case>> failed_tests;
 
@@ -270,22 +944,73 @@ namespace stfu {
             auto *root_test = new impl::test_case(name, func, impl::current_test);
             impl::root = std::shared_ptr<impl::test_case>(root_test);
 
+            /// Opened once per root test instead of once per cycle. Opening
+            /// perf events costs a few syscalls which we dont want to count
+            std::unique_ptr<impl::perf_sampler> sampler;
+            if (options().perf) {
+                sampler.reset(new impl::perf_sampler());
+            }
+
+            size_t executed_before = stats.executed;
+            bool any_cycle_failed = false;
+
             /// We might need multiple iterations of root to execute
             /// all test cases as we are only executing 1 leaf at a time
-            while (impl::root->should_run()) {
+            while (impl::root->should_run() && !stats.cancelled) {
+                stats.cycle_failed = false;
+                if (sampler) {
+                    sampler->start();
+                }
+                auto start = std::chrono::steady_clock::now();
                 try {
                     impl::root->run();
                 } catch (std::exception &exception) {
                     std::cout << name << " failed: " << exception.what() << '\n';
                     failed_tests.push_back(impl::root);
+                    stats.cycle_failed = true;
                 } catch (...) {
                     std::cout << "Unknown exception caught\n";
                     failed_tests.push_back(impl::root);
+                    stats.cycle_failed = true;
+                }
+
+                auto elapsed = std::chrono::steady_clock::now() - start;
+                auto *leaf = impl::root->executing_leaf();
+                leaf->duration = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+
+                if (sampler) {
+                    print_perf(leaf->path(), sampler->stop());
                 }
 
                 impl::root->cycle_complete();
+
+                stats.executed++;
+                if (stats.cycle_failed) {
+                    any_cycle_failed = true;
+                    stats.failed++;
+                    if (options().max_failures && stats.failed >= options().max_failures) {
+                        stats.cancelled = true;
+                    }
+                }
+            }
+
+            if (stats.cancelled) {
+                /// The live tree only knows the children of parents that
+                /// already ran. The manifest might know more
+                size_t pending = impl::root->pending_leaves();
+                size_t recorded = recorded_leaves(name);
+                size_t executed = stats.executed - executed_before;
+                if (recorded > executed) {
+                    pending = std::max(pending, recorded - executed);
+                }
+                stats.skipped += pending;
             }
 
+            /// A root that failed or was cancelled only saw part of its
+            /// tree. It is merged into the recorded tree instead of
+            /// replacing it
+            update_manifest(impl::root->to_manifest(), !stats.cancelled && !any_cycle_failed);
+
             /// After running all the test cases, we are resetting the nodes.
             /// This allows the runner to be called multiple times.
             /// I dont know why I added this functionality. It is probably
@@ -299,8 +1024,20 @@ namespace stfu {
         using namespace stfu::impl;
 
         if (!root) {
+            ensure_exit_hook();
+
+            if (options().list || !in_current_shard(name)) {
+                return 0;
+            }
+
+            /// Only roots this shard would have run count as skipped
+            if (stats.cancelled) {
+                stats.skipped += std::max<size_t>(recorded_leaves(name), 1);
+                return 0;
+            }
+
             run_tests(name, func);
-            return 0;
+            return 1;
         }
 
         /// Ensure current test is not null. There is no case in which
@@ -309,6 +1046,89 @@ namespace stfu {
         current_test->add_child(std::make_shared<test_case>(name, func, current_test));
         return 0;
     }
+
+    void configure(int argc, const char *const *argv) {
+        using namespace stfu::impl;
+        ensure_exit_hook();
+
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+
+            if (arg == "--list") {
+                options().list = true;
+            } else if (arg == "--perf") {
+                options().perf = true;
+            } else if (arg == "--fail-fast") {
+                options().max_failures = 1;
+            } else if (arg == "--max-failures" || arg.compare(0, 15, "--max-failures=") == 0) {
+                std::string value;
+                if (arg.size() > 14) {
+                    value = arg.substr(15);
+                } else if (i + 1 < argc) {
+                    value = argv[++i];
+                }
+
+                if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos) {
+                    throw std::invalid_argument("--max-failures expects a number");
+                }
+                options().max_failures = std::stoul(value);
+            } else if (arg == "--no-manifest") {
+                options().use_manifest = false;
+            } else if (arg.compare(0, 11, "--manifest=") == 0) {
+                options().manifest_path = arg.substr(11);
+
+                /// Roots that already ran, like the ones in static variables,
+                /// belong in the new file too. Only what was loaded from the
+                /// old file is dropped
+                auto &state = manifest_state();
+                std::vector<manifest_node> ours;
+                for (const auto &root : state.roots) {
+                    if (std::find(state.updated.begin(), state.updated.end(), root.name) != state.updated.end()) {
+                        ours.push_back(root);
+                    }
+                }
+                state.roots = std::move(ours);
+                state.loaded = false;
+            } else if (arg.compare(0, 8, "--shard=") == 0) {
+                auto slash = arg.find('/');
+                if (slash == std::string::npos) {
+                    throw std::invalid_argument("--shard expects <k>/<n>");
+                }
+                options().shard_index = std::stoul(arg.substr(8, slash - 8));
+                options().shard_count = std::stoul(arg.substr(slash + 1));
+                if (options().shard_count == 0 || options().shard_index >= options().shard_count) {
+                    throw std::invalid_argument("--shard expects k < n");
+                }
+                shard_plan() = shard_plan_t();
+            }
+        }
+
+        if (options().list) {
+            auto &state = manifest_state();
+            if (!options().use_manifest || !manifest_io::load(options().manifest_path, state.roots)) {
+                std::cout << "No manifest found at " << options().manifest_path
+                          << ". Run the tests once to create it\n";
+                return;
+            }
+            state.loaded = true;
+
+            for (const auto &node : state.roots) {
+                print_leaves(node, "");
+            }
+        }
+    }
+
+    bool list_only() {
+        return impl::options().list;
+    }
+
+    int report() {
+        using namespace stfu::impl;
+
+        print_summary();
+        stats.reported = true;
+        return exit_status();
+    }
 } /// namespace stfu
 #endif /// end if for STFU_IMPL
 
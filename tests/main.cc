@@ -3,11 +3,82 @@
 #include <iostream>
 #include <cassert>
 #include <stfu/stfu.h>
+#include <stfu/perf.h>
 
+#include <map>
+
+
+/// Swaps the run wide state of stfu for a fresh one and puts the real one
+/// back when destroyed, even if an expect failed in between. That lets a
+/// test run root tests of its own. The manifest is off unless the test
+/// turns it on
+struct fresh_state {
+    stfu::impl::options_t options = stfu::impl::options();
+    stfu::impl::manifest_state_t manifest = stfu::impl::manifest_state();
+    stfu::impl::shard_plan_t shard_plan = stfu::impl::shard_plan();
+    stfu::impl::stats_t stats = stfu::impl::stats;
+    std::shared_ptr<stfu::impl::test_case> root = stfu::impl::root;
+    stfu::impl::test_case *current_test = stfu::impl::current_test;
+
+    fresh_state() {
+        stfu::impl::options() = stfu::impl::options_t();
+        stfu::impl::options().use_manifest = false;
+        stfu::impl::stats = stfu::impl::stats_t();
+        stfu::impl::root.reset();
+        stfu::impl::current_test = nullptr;
+        new_process();
+    }
+
+    /// Forgets what was loaded from the manifest like a new process would
+    static void new_process() {
+        stfu::impl::manifest_state() = stfu::impl::manifest_state_t();
+        stfu::impl::shard_plan() = stfu::impl::shard_plan_t();
+    }
+
+    ~fresh_state() {
+        stfu::impl::options() = options;
+        stfu::impl::manifest_state() = manifest;
+        stfu::impl::shard_plan() = shard_plan;
+        stfu::impl::stats = stats;
+        stfu::impl::root = root;
+        stfu::impl::current_test = current_test;
+    }
+};
+
+
+/// A root with the given leaves. If fail is true, it throws right after
+/// declaring the first leaf
+static std::function<void()> suite(std::vector<std::string> leaves, bool fail) {
+    return [leaves, fail] {
+        for (const auto &leaf : leaves) {
+            stfu::test(leaf, [] {});
+            if (fail) {
+                throw std::runtime_error("suite fails on purpose");
+            }
+        }
+    };
+}
+
+
+static std::string leaf_names(const stfu::impl::manifest_node &node) {
+    std::string names;
+    for (const auto &child : node.children) {
+        names += child.name;
+    }
+    return names;
+}
+
+
+int main(int argc, char **argv) {
+    stfu::configure(argc, argv);
+
+    /// --list only prints the manifest. Nothing below runs in that case
+    if (stfu::list_only()) {
+        return 0;
+    }
 
-int main() {
     int parent = 0, child1 = 0, child2 = 0, grandchild1 = 0, grandchild2 = 0, grandchild3 = 0, grandchild4 = 0;
-    stfu::test("Parent", [&] {
+    int parent_ran = stfu::test("Parent", [&] {
         parent++;
 
         stfu::test("Child 1", [&] {
@@ -37,15 +108,19 @@ int main() {
 
     /// flush the output for debugging
     std::cout << std::endl;
-    assert(grandchild1 == 1);
-    assert(grandchild2 == 1);
-    assert(grandchild3 == 1);
-    assert(grandchild4 == 1);
 
-    assert(child1 == 2);
-    assert(child2 == 2);
+    /// --shard might have put Parent in another shard
+    if (parent_ran) {
+        assert(grandchild1 == 1);
+        assert(grandchild2 == 1);
+        assert(grandchild3 == 1);
+        assert(grandchild4 == 1);
+
+        assert(child1 == 2);
+        assert(child2 == 2);
 
-    assert(parent == 4);
+        assert(parent == 4);
+    }
 
     stfu::test("more tests can be executed", [] {
         stfu::test("1 == 1", [] {
@@ -109,6 +184,303 @@ int main() {
         expect(false);
     });
 
+    stfu::test("manifest tests", [] {
+        stfu::test("manifest survives a round trip through the disk", [] {
+            stfu::impl::manifest_node root;
+            root.name = "root";
+            stfu::impl::manifest_node leaf;
+            leaf.name = "leaf";
+            leaf.duration = 1234567890123ULL;
+            root.children.push_back(leaf);
+
+            std::string path = "stfu_round_trip.manifest";
+            stfu::impl::manifest_io::save(path, {root});
+
+            std::vector<stfu::impl::manifest_node> loaded;
+            expect(stfu::impl::manifest_io::load(path, loaded) == true);
+            std::remove(path.c_str());
+
+            expect(loaded.size() == 1u);
+            expect(loaded[0].name == "root");
+            expect(loaded[0].children.size() == 1u);
+            expect(loaded[0].children[0].duration == 1234567890123ULL);
+            expect(loaded[0].cost() == 1234567890123ULL);
+        });
+
+        stfu::test("loading a missing manifest fails", [] {
+            std::vector<stfu::impl::manifest_node> loaded;
+            expect(stfu::impl::manifest_io::load("does_not_exist.manifest", loaded) == false);
+        });
+
+        stfu::test("loading a manifest with a corrupt name length fails", [] {
+            using namespace stfu::impl;
+            std::string path = "stfu_corrupt.manifest";
+            {
+                std::ofstream file(path, std::ios::binary);
+                file.write("STFU", 4);
+                manifest_io::write_int(file, manifest_io::version, 4);
+                manifest_io::write_int(file, 1, 4);
+                manifest_io::write_int(file, 0xffffffff, 4);
+                file.write("abc", 3);
+            }
+
+            std::vector<manifest_node> loaded;
+            bool result = manifest_io::load(path, loaded);
+            std::remove(path.c_str());
+            expect(result == false);
+        });
+
+        stfu::test("a clean run records the whole tree", [] {
+            using namespace stfu::impl;
+            fresh_state state;
+            std::string path = "stfu_test.manifest";
+            std::remove(path.c_str());
+            options().use_manifest = true;
+            options().manifest_path = path;
+
+            stfu::test("suite", suite({"a", "b", "c"}, false));
+            flush_manifest();
+
+            std::vector<manifest_node> on_disk;
+            bool loaded = manifest_io::load(path, on_disk);
+            std::remove(path.c_str());
+            expect(loaded == true);
+            expect(on_disk.size() == 1u);
+            expect(leaf_names(on_disk[0]) == "abc");
+        });
+
+        stfu::test("a failing root keeps the leaves it did not see", [] {
+            using namespace stfu::impl;
+            fresh_state state;
+            std::string path = "stfu_test.manifest";
+            std::remove(path.c_str());
+            options().use_manifest = true;
+            options().manifest_path = path;
+
+            stfu::test("suite", suite({"a", "b", "c"}, false));
+            flush_manifest();
+
+            fresh_state::new_process();
+            stfu::test("suite", suite({"a", "b", "c"}, true));
+            std::remove(path.c_str());
+            expect(leaf_names(get_manifest()[0]) == "abc");
+        });
+
+        stfu::test("a clean run replaces a tree that drifted", [] {
+            using namespace stfu::impl;
+            fresh_state state;
+            std::string path = "stfu_test.manifest";
+            std::remove(path.c_str());
+            options().use_manifest = true;
+            options().manifest_path = path;
+
+            stfu::test("suite", suite({"a", "b", "c"}, false));
+            flush_manifest();
+
+            fresh_state::new_process();
+            stfu::test("suite", suite({"a", "d"}, false));
+            std::remove(path.c_str());
+            expect(leaf_names(get_manifest()[0]) == "ad");
+        });
+
+        stfu::test("roots with the same name in one run are merged", [] {
+            using namespace stfu::impl;
+            fresh_state state;
+            options().use_manifest = true;
+            options().manifest_path = "stfu_test.manifest";
+
+            stfu::test("suite", suite({"a", "d"}, false));
+            stfu::test("suite", suite({"e"}, false));
+            expect(get_manifest().size() == 1u);
+            expect(leaf_names(get_manifest()[0]) == "ade");
+        });
+
+        stfu::test("changing the manifest path keeps roots that already ran", [] {
+            using namespace stfu::impl;
+            fresh_state state;
+            std::string first = "stfu_first.manifest", second = "stfu_second.manifest";
+            std::remove(second.c_str());
+            options().use_manifest = true;
+            options().manifest_path = first;
+
+            stfu::test("before configure", suite({"a"}, false));
+            const char *argv[] = {"stfu", "--manifest=stfu_second.manifest"};
+            stfu::configure(2, argv);
+            stfu::test("after configure", suite({"b"}, false));
+            flush_manifest();
+
+            std::vector<manifest_node> on_disk;
+            bool loaded = manifest_io::load(second, on_disk);
+            std::remove(first.c_str());
+            std::remove(second.c_str());
+            expect(loaded == true);
+            expect(on_disk.size() == 2u);
+            expect(on_disk[0].name == "before configure");
+            expect(on_disk[1].name == "after configure");
+        });
+    });
+
+    stfu::test("shard tests", [] {
+        stfu::test("shards are balanced by recorded cost, not by leaf count", [] {
+            using namespace stfu::impl;
+            fresh_state state;
+            std::string path = "stfu_test.manifest";
+            options().use_manifest = true;
+            options().manifest_path = path;
+            options().shard_count = 2;
+
+            auto make_root = [](const std::string &name, uint64_t leaf_duration, size_t leaves) {
+                manifest_node root;
+                root.name = name;
+                for (size_t i = 0; i < leaves; i++) {
+                    manifest_node leaf;
+                    leaf.name = std::to_string(i);
+                    leaf.duration = leaf_duration;
+                    root.children.push_back(leaf);
+                }
+                return root;
+            };
+            manifest_io::save(path, {
+                    make_root("costs 4", 1, 4),
+                    make_root("costs 10", 10, 1),
+                    make_root("costs 5", 5, 1),
+                    make_root("costs 7", 7, 1)
+            });
+
+            size_t ten = shard_for("costs 10"), seven = shard_for("costs 7");
+            size_t five = shard_for("costs 5"), four = shard_for("costs 4");
+            std::remove(path.c_str());
+            expect(ten == 0u);
+            expect(seven == 1u);
+            expect(five == 1u);
+            expect(four == 0u);
+        });
+
+        stfu::test("roots missing from the manifest are hashed the same way every time", [] {
+            using namespace stfu::impl;
+            fresh_state state;
+            options().shard_count = 2;
+
+            size_t shard = shard_for("never recorded");
+            expect(shard < 2u);
+            fresh_state::new_process();
+            expect(shard_for("never recorded") == shard);
+        });
+
+        stfu::test("running every shard one after another runs every root exactly once", [] {
+            using namespace stfu::impl;
+            fresh_state state;
+            std::string path = "stfu_test.manifest";
+            std::remove(path.c_str());
+            options().use_manifest = true;
+            options().manifest_path = path;
+
+            std::map<std::string, int> runs;
+            auto run_roots = [&](const std::vector<std::string> &names) {
+                for (const auto &name : names) {
+                    stfu::test(name, [&runs, name] { runs[name]++; });
+                }
+            };
+
+            /// Only some of the roots are in the manifest. The rest are new
+            run_roots({"A", "B", "C"});
+            flush_manifest();
+            runs.clear();
+
+            for (size_t shard = 0; shard < 3; shard++) {
+                fresh_state::new_process();
+                options().shard_index = shard;
+                options().shard_count = 3;
+                run_roots({"A", "B", "C", "D", "E", "F"});
+                flush_manifest();
+            }
+            std::remove(path.c_str());
+
+            expect(runs.size() == 6u);
+            for (const auto &run : runs) {
+                expect(run.second == 1);
+            }
+        });
+    });
+
+    stfu::test("fail fast tests", [] {
+        stfu::test("fail fast cancels the rest of the run", [] {
+            using namespace stfu::impl;
+            fresh_state state;
+            options().max_failures = 1;
+
+            int leaves_run = 0;
+            stfu::test("fail fast", [&] {
+                stfu::test("first leaf fails", [&] {
+                    leaves_run++;
+                    expect(false);
+                });
+                stfu::test("second leaf", [&] { leaves_run++; });
+                stfu::test("third leaf", [&] { leaves_run++; });
+            });
+
+            int roots_run = 0;
+            stfu::test("root after cancellation", [&] { roots_run++; });
+
+            expect(leaves_run == 1);
+            expect(roots_run == 0);
+            expect(stats.cancelled == true);
+            expect(stats.failed == 1u);
+            /// second leaf, third leaf and the root that never ran
+            expect(stats.skipped == 3u);
+        });
+
+        stfu::test("roots of other shards are not counted as skipped", [] {
+            using namespace stfu::impl;
+            fresh_state state;
+            options().max_failures = 1;
+            options().shard_count = 2;
+            options().shard_index = shard_for("fail fast");
+
+            std::string ours, theirs;
+            for (int i = 0; ours.empty() || theirs.empty(); i++) {
+                std::string name = "root " + std::to_string(i);
+                (shard_for(name) == options().shard_index ? ours : theirs) = name;
+            }
+
+            stfu::test("fail fast", [] { expect(false); });
+            stfu::test(ours, [] {});
+            stfu::test(theirs, [] {});
+
+            expect(stats.cancelled == true);
+            expect(stats.skipped == 1u);
+        });
+    });
+
+    stfu::test("perf tests", [] {
+        stfu::test("measure reports CPU time spent in the callable", [] {
+            volatile uint64_t sum = 0;
+            auto counters = stfu::measure([&] {
+                for (uint64_t i = 0; i < 1000000; i++) {
+                    sum = sum + i;
+                }
+            });
+            expect(counters.cpu_time > 0u);
+
+            if (counters.hardware) {
+                expect(counters.instructions > 1000000u);
+            }
+        });
+
+        stfu::test("per_call divides every reading by the number of calls", [] {
+            stfu::perf_counters counters;
+            counters.instructions = 1000;
+            counters.cpu_time = 500;
+            auto single = counters.per_call(10);
+            expect(single.instructions == 100u);
+            expect(single.cpu_time == 50u);
+        });
+
+        stfu::test("measure propagates exceptions from the callable", [] {
+            expectThrows(int, [] { stfu::measure([] { throw 0; }); });
+        });
+    });
+
     stfu::test("expectThrows tests", [] {
         stfu::test("expectThrows does nothing when exception of the given type is thrown", [] {
             expectThrows(int, [] { throw 0; });
@@ -138,4 +510,9 @@ int main() {
             }
         });
     });
+
+    /// "just trying to see the error message when test fails" fails
+    /// on purpose. So unless --shard put it in another shard, the exit
+    /// code says something failed
+    return stfu::report();
 }